@@ -33,23 +33,59 @@
 #endif
 
 #include <QTimer>
+
+#if QT_VERSION >= 0x040700
+#include <QElapsedTimer>
+#endif
+
 #include <QByteArray>
+#include <math.h>
 #include <QNetworkRequest>
 #include <QNetworkProxy>
+
+#if QT_VERSION >= 0x050200
+#include <QSaveFile>
+#endif
 #include "CutyCapt.hpp"
 
+#ifdef CUTYCAPT_WEBP
+#include <webp/encode.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
 #if QT_VERSION >= 0x040600 && 0
 #define CUTYCAPT_SCRIPT 1
 #endif
 
+// Static builds only link the codecs listed in CUTYCAPT_IMAGE_PLUGINS,
+// see CutyCapt.pro; dynamic builds load them on first use anyway.
 #ifdef STATIC_PLUGINS
+#ifdef STATIC_PLUGIN_QJPEG
   Q_IMPORT_PLUGIN(qjpeg)
+#endif
+#ifdef STATIC_PLUGIN_QGIF
   Q_IMPORT_PLUGIN(qgif)
+#endif
+#ifdef STATIC_PLUGIN_QTIFF
   Q_IMPORT_PLUGIN(qtiff)
+#endif
+#ifdef STATIC_PLUGIN_QSVG
   Q_IMPORT_PLUGIN(qsvg)
+#endif
+#ifdef STATIC_PLUGIN_QMNG
   Q_IMPORT_PLUGIN(qmng)
+#endif
+#ifdef STATIC_PLUGIN_QICO
   Q_IMPORT_PLUGIN(qico)
 #endif
+#endif
 
 static struct _CutyExtMap {
   CutyCapt::OutputFormat id;
@@ -73,6 +109,9 @@ static struct _CutyExtMap {
   { CutyCapt::PpmFormat,         ".ppm",        "ppm"   },
   { CutyCapt::XbmFormat,         ".xbm",        "xbm"   },
   { CutyCapt::XpmFormat,         ".xpm",        "xpm"   },
+#ifdef CUTYCAPT_WEBP
+  { CutyCapt::WebpFormat,        ".webp",       "webp"  },
+#endif
   { CutyCapt::OtherFormat,       "",            ""      }
 };
 
@@ -158,6 +197,505 @@ CutyPage::setAttribute(QWebSettings::WebAttribute option,
     (void)0; // TODO: ...
 }
 
+// QElapsedTimer is monotonic, but only exists since Qt 4.7
+#if QT_VERSION >= 0x040700
+typedef QElapsedTimer CutyClock;
+#else
+typedef QTime CutyClock;
+#endif
+
+// Timeline of initialization phases since main() was entered, see
+// --startup-profile
+static bool CutyStartupProfile = false;
+static CutyClock CutyStartupClock;
+
+static void
+CutyStartupMark(const char* phase) {
+  if (CutyStartupProfile)
+    qDebug() << "[startup]" << CutyStartupClock.elapsed() << "ms" << phase;
+}
+
+// Resident set size of the process in kilobytes, -1 if unknown.
+static long
+CutyResidentSetSize() {
+#ifdef Q_OS_LINUX
+  QFile file("/proc/self/statm");
+
+  if (!file.open(QIODevice::ReadOnly))
+    return -1;
+
+  QList<QByteArray> fields = file.readAll().split(' ');
+
+  if (fields.size() < 2)
+    return -1;
+
+  return fields[1].toLong() * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+  return -1;
+#endif
+}
+
+#ifdef CUTYCAPT_WEBP
+static int
+CutyWebpWrite(const uint8_t* data, size_t size, const WebPPicture* picture) {
+  QIODevice* device = static_cast<QIODevice*>(picture->custom_ptr);
+  return device->write((const char*)data, size) == (qint64)size;
+}
+
+// Encodes the image with libwebp and streams the result into the
+// file. QImage::Format_ARGB32 holds native 0xAARRGGBB words, which
+// is the layout libwebp uses, so the rendered buffer is encoded in
+// place rather than converted or copied first. Lossless encoding
+// may change the colour of fully transparent pixels in the buffer.
+static bool
+CutyWebpSave(QImage& image, const QString& output,
+             bool lossless, int quality, int method) {
+  WebPConfig config;
+  WebPPicture picture;
+  QFile file(output);
+
+  if (image.width() > WEBP_MAX_DIMENSION || image.height() > WEBP_MAX_DIMENSION) {
+    qDebug() << "[webp] cannot encode" << image.width() << "x" << image.height()
+             << "pixels, WebP allows at most" << WEBP_MAX_DIMENSION
+             << "in either dimension";
+    return false;
+  }
+
+  if (!WebPConfigInit(&config) || !WebPPictureInit(&picture))
+    return false;
+
+  config.lossless = lossless;
+  config.quality = quality;
+  config.method = method;
+
+  if (!WebPValidateConfig(&config)) {
+    qDebug() << "[webp] invalid quality or method setting";
+    return false;
+  }
+
+  if (!file.open(QIODevice::WriteOnly))
+    return false;
+
+  picture.use_argb = 1;
+  picture.width = image.width();
+  picture.height = image.height();
+  picture.argb = (uint32_t*)image.bits();
+  picture.argb_stride = image.bytesPerLine() / 4;
+  picture.writer = CutyWebpWrite;
+  picture.custom_ptr = &file;
+
+  bool ok = WebPEncode(&config, &picture);
+
+  if (!ok) {
+    qDebug() << "[webp] encoding failed with error" << picture.error_code;
+    file.remove();
+  }
+
+  WebPPictureFree(&picture);
+  return ok;
+}
+#endif
+
+CutySvgDevice::CutySvgDevice(const QString& output, bool external)
+  : mFile(output) {
+  mExternal = external;
+  mScanned = 0;
+}
+
+bool
+CutySvgDevice::open(OpenMode mode) {
+  if (!mFile.open(mode))
+    return false;
+
+  return QIODevice::open(mode);
+}
+
+void
+CutySvgDevice::close() {
+  if (!isOpen())
+    return;
+
+  process(true);
+  mFile.write(mPending);
+  mPending.clear();
+  mFile.close();
+  QIODevice::close();
+}
+
+qint64
+CutySvgDevice::readData(char* /*data*/, qint64 /*maxSize*/) {
+  return -1;
+}
+
+qint64
+CutySvgDevice::writeData(const char* data, qint64 maxSize) {
+  mPending.append(data, maxSize);
+  process(false);
+  return maxSize;
+}
+
+// Copies everything up to the next <image> element to the file and
+// replaces complete elements as they come in; QSvgGenerator writes
+// in chunks, so an element can span many calls.
+void
+CutySvgDevice::process(bool final) {
+  static const QByteArray marker("<image ");
+  int done = 0;
+
+  for (;;) {
+    int start = mPending.indexOf(marker, done);
+
+    if (start < 0) {
+      // The chunk might end in the middle of "<image "
+      int keep = final ? 0 : qMin(mPending.size() - done, marker.size() - 1);
+      mFile.write(mPending.constData() + done, mPending.size() - done - keep);
+      done = mPending.size() - keep;
+      break;
+    }
+
+    mFile.write(mPending.constData() + done, start - done);
+    done = start;
+
+    // Data URLs can be huge, don't scan them again for every chunk
+    int end = mPending.indexOf("/>", start == 0 ? mScanned : start);
+
+    if (end < 0) {
+      mScanned = qMax(0, mPending.size() - start - 1);
+      break;
+    }
+
+    mFile.write(rewriteImage(mPending.mid(start, end + 2 - start)));
+    mScanned = 0;
+    done = end + 2;
+  }
+
+  mPending.remove(0, done);
+}
+
+static QByteArray
+CutySvgAttribute(const QByteArray& tag, const char* name) {
+  QByteArray key = QByteArray(" ") + name + "=\"";
+  int start = tag.indexOf(key);
+
+  if (start < 0)
+    return QByteArray();
+
+  start += key.size();
+  int end = tag.indexOf('"', start);
+
+  return end < 0 ? QByteArray() : tag.mid(start, end - start);
+}
+
+QByteArray
+CutySvgDevice::rewriteImage(const QByteArray& tag) {
+  static const QByteArray prefix("data:image/png;base64,");
+  QByteArray href = CutySvgAttribute(tag, "xlink:href");
+
+  if (!href.startsWith(prefix))
+    return tag;
+
+  QByteArray id = "i" + QCryptographicHash::hash(href,
+    QCryptographicHash::Sha1).toHex().left(16);
+
+  QByteArray result;
+
+  // The image is defined at unit size so that every occurrence can
+  // place and scale it with a transform on the <use> element.
+  if (!mSeen.contains(id)) {
+    mSeen.insert(id);
+
+    if (mExternal) {
+      QFileInfo info(mFile.fileName());
+      QString name = info.completeBaseName() + "-" + id + ".png";
+      QFile image(info.dir().filePath(name));
+
+      // Percent-encoding leaves no characters that are special in
+      // XML attributes or in a relative URL such as '#' or '%'.
+      if (image.open(QIODevice::WriteOnly)) {
+        image.write(QByteArray::fromBase64(href.mid(prefix.size())));
+        href = QUrl::toPercentEncoding(name);
+      }
+    }
+
+    result += "<defs><image id=\"" + id + "\" width=\"1\" height=\"1\" "
+              "preserveAspectRatio=\"none\" xlink:href=\"" + href + "\" /></defs>";
+  }
+
+  result += "<use xlink:href=\"#" + id + "\" transform=\"translate("
+         + CutySvgAttribute(tag, "x") + "," + CutySvgAttribute(tag, "y")
+         + ") scale(" + CutySvgAttribute(tag, "width") + ","
+         + CutySvgAttribute(tag, "height") + ")\" />";
+
+  return result;
+}
+
+CutyDownsampleEngine::CutyDownsampleEngine(QPainter* target, int dpi)
+  : QPaintEngine(AllFeatures) {
+  mTarget = target;
+  mScale = qreal(dpi) / target->device()->logicalDpiX();
+  mTextureKey = 0;
+}
+
+bool
+CutyDownsampleEngine::begin(QPaintDevice* /*device*/) {
+  return true;
+}
+
+bool
+CutyDownsampleEngine::end() {
+  return true;
+}
+
+QPaintEngine::Type
+CutyDownsampleEngine::type() const {
+  return QPaintEngine::User;
+}
+
+void
+CutyDownsampleEngine::updateState(const QPaintEngineState& state) {
+  QPaintEngine::DirtyFlags flags = state.state();
+
+  if (flags & DirtyPen)
+    mTarget->setPen(state.pen());
+
+  if (flags & DirtyBrush)
+    mBrush = state.brush();
+
+  if (flags & DirtyBrushOrigin)
+    mTarget->setBrushOrigin(state.brushOrigin());
+
+  if (flags & DirtyFont)
+    mTarget->setFont(state.font());
+
+  if (flags & DirtyBackground)
+    mTarget->setBackground(state.backgroundBrush());
+
+  if (flags & DirtyBackgroundMode)
+    mTarget->setBackgroundMode(state.backgroundMode());
+
+  // setRenderHints() only turns hints on
+  if (flags & DirtyHints) {
+    mTarget->setRenderHints(mTarget->renderHints(), false);
+    mTarget->setRenderHints(state.renderHints());
+  }
+
+  if (flags & DirtyCompositionMode)
+    mTarget->setCompositionMode(state.compositionMode());
+
+  if (flags & DirtyOpacity)
+    mTarget->setOpacity(state.opacity());
+
+  // Clips are specified in the coordinate system that is current
+  // when they are set, so the transform has to be applied first.
+  if (flags & DirtyTransform)
+    mTarget->setTransform(state.transform());
+
+  // How far a texture brush can be scaled down depends on both
+  if ((flags & DirtyBrush) || ((flags & DirtyTransform) &&
+      mBrush.style() == Qt::TexturePattern))
+    updateBrush();
+
+  if (flags & DirtyClipRegion)
+    mTarget->setClipRegion(state.clipRegion(), state.clipOperation());
+
+  if (flags & DirtyClipPath)
+    mTarget->setClipPath(state.clipPath(), state.clipOperation());
+
+  if (flags & DirtyClipEnabled)
+    mTarget->setClipping(state.isClipEnabled());
+}
+
+void
+CutyDownsampleEngine::drawPath(const QPainterPath& path) {
+  mTarget->drawPath(path);
+}
+
+void
+CutyDownsampleEngine::drawPolygon(const QPointF* points, int pointCount,
+                                  PolygonDrawMode mode) {
+  switch (mode) {
+    case OddEvenMode:
+      mTarget->drawPolygon(points, pointCount, Qt::OddEvenFill);
+      break;
+    case WindingMode:
+      mTarget->drawPolygon(points, pointCount, Qt::WindingFill);
+      break;
+    case ConvexMode:
+      mTarget->drawConvexPolygon(points, pointCount);
+      break;
+    case PolylineMode:
+      mTarget->drawPolyline(points, pointCount);
+      break;
+  }
+}
+
+void
+CutyDownsampleEngine::drawRects(const QRectF* rects, int rectCount) {
+  mTarget->drawRects(rects, rectCount);
+}
+
+void
+CutyDownsampleEngine::drawLines(const QLineF* lines, int lineCount) {
+  mTarget->drawLines(lines, lineCount);
+}
+
+void
+CutyDownsampleEngine::drawEllipse(const QRectF& rect) {
+  mTarget->drawEllipse(rect);
+}
+
+void
+CutyDownsampleEngine::drawPoints(const QPointF* points, int pointCount) {
+  mTarget->drawPoints(points, pointCount);
+}
+
+void
+CutyDownsampleEngine::drawTextItem(const QPointF& p, const QTextItem& textItem) {
+  mTarget->drawTextItem(p, textItem);
+}
+
+// QtWebKit paints CSS background images as tiled pixmaps and with
+// texture brushes, so those are scaled down per tile like images.
+void
+CutyDownsampleEngine::drawTiledPixmap(const QRectF& r, const QPixmap& pixmap,
+                                      const QPointF& s) {
+  QSize limit = limitFor(QRectF(QPointF(0, 0), pixmap.size()));
+
+  if (pixmap.width() <= limit.width() && pixmap.height() <= limit.height()) {
+    mTarget->drawTiledPixmap(r, pixmap, s);
+    return;
+  }
+
+  QPixmap scaled = scaledTexture(pixmap, limit);
+  qreal sx = qreal(pixmap.width()) / scaled.width();
+  qreal sy = qreal(pixmap.height()) / scaled.height();
+
+  mTarget->save();
+  mTarget->translate(r.topLeft());
+  mTarget->scale(sx, sy);
+  mTarget->drawTiledPixmap(QRectF(0, 0, r.width() / sx, r.height() / sy),
+    scaled, QPointF(s.x() / sx, s.y() / sy));
+  mTarget->restore();
+}
+
+// Scales a tile down to fit the limit, reusing the last result as
+// the same texture tends to be painted many times in a row.
+QPixmap
+CutyDownsampleEngine::scaledTexture(const QPixmap& texture, const QSize& limit) {
+  QSize size = texture.size().boundedTo(limit);
+
+  if (mTextureKey != texture.cacheKey() || mTexture.size() != size) {
+    mTextureKey = texture.cacheKey();
+    mTexture = QPixmap::fromImage(texture.toImage().scaled(size,
+      Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+  }
+
+  return mTexture;
+}
+
+void
+CutyDownsampleEngine::updateBrush() {
+  if (mBrush.style() != Qt::TexturePattern) {
+    mTarget->setBrush(mBrush);
+    return;
+  }
+
+  QPixmap texture = mBrush.texture();
+  QSize limit = limitFor(mBrush.transform().mapRect(QRectF(texture.rect())));
+
+  if (texture.width() <= limit.width() && texture.height() <= limit.height()) {
+    mTarget->setBrush(mBrush);
+    return;
+  }
+
+  // The brush transform maps the smaller tile back onto the area
+  // the original tile covered, so the pattern keeps its period.
+  QPixmap scaled = scaledTexture(texture, limit);
+  QBrush brush(scaled);
+  brush.setTransform(QTransform().scale(
+    qreal(texture.width()) / scaled.width(),
+    qreal(texture.height()) / scaled.height()) * mBrush.transform());
+  mTarget->setBrush(brush);
+}
+
+// Size in pixels that an image drawn into r needs at most
+QSize
+CutyDownsampleEngine::limitFor(const QRectF& r) const {
+  QSizeF size = mTarget->transform().mapRect(r).size() * mScale;
+  return QSize(qMax(1, (int)ceil(size.width())), qMax(1, (int)ceil(size.height())));
+}
+
+void
+CutyDownsampleEngine::drawPixmap(const QRectF& r, const QPixmap& pm,
+                                 const QRectF& sr) {
+  QSize limit = limitFor(r);
+
+  if (sr.width() <= limit.width() && sr.height() <= limit.height()) {
+    mTarget->drawPixmap(r, pm, sr);
+    return;
+  }
+
+  drawImage(r, pm.toImage(), sr, Qt::AutoColor);
+}
+
+void
+CutyDownsampleEngine::drawImage(const QRectF& r, const QImage& image,
+                                const QRectF& sr, Qt::ImageConversionFlags flags) {
+  QSize limit = limitFor(r);
+
+  if (sr.width() <= limit.width() && sr.height() <= limit.height()) {
+    mTarget->drawImage(r, image, sr, flags);
+    return;
+  }
+
+  QImage scaled = image.copy(sr.toAlignedRect()).scaled(limit,
+    Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+  mTarget->drawImage(r, scaled, QRectF(scaled.rect()), flags);
+}
+
+CutyDownsampleDevice::CutyDownsampleDevice(QPainter* target, int dpi) {
+  mDevice = target->device();
+  mEngine = new CutyDownsampleEngine(target, dpi);
+}
+
+CutyDownsampleDevice::~CutyDownsampleDevice() {
+  delete mEngine;
+}
+
+QPaintEngine*
+CutyDownsampleDevice::paintEngine() const {
+  return mEngine;
+}
+
+int
+CutyDownsampleDevice::metric(PaintDeviceMetric metric) const {
+  switch (metric) {
+    case PdmWidth:         return mDevice->width();
+    case PdmHeight:        return mDevice->height();
+    case PdmWidthMM:       return mDevice->widthMM();
+    case PdmHeightMM:      return mDevice->heightMM();
+#if QT_VERSION >= 0x040600
+    case PdmNumColors:     return mDevice->colorCount();
+#else
+    case PdmNumColors:     return mDevice->numColors();
+#endif
+    case PdmDepth:         return mDevice->depth();
+    case PdmDpiX:          return mDevice->logicalDpiX();
+    case PdmDpiY:          return mDevice->logicalDpiY();
+    case PdmPhysicalDpiX:  return mDevice->physicalDpiX();
+    case PdmPhysicalDpiY:  return mDevice->physicalDpiY();
+    default:               return QPaintDevice::metric(metric);
+  }
+}
+
+// scheme://host:port, the unit connections are made and reused for
+static QString
+CutyOrigin(const QUrl& url) {
+  return url.scheme() + "://" + url.host() + ":" +
+    QString::number(url.port(url.scheme() == "https" ? 443 : 80));
+}
+
 // TODO: Consider merging some of main() and CutyCap
 
 CutyCapt::CutyCapt(CutyPage* page, const QString& output, int delay, OutputFormat format,
@@ -174,15 +712,139 @@ CutyCapt::CutyCapt(CutyPage* page, const QString& output, int delay, OutputForma
   mScriptProp = scriptProp;
   mScriptCode = scriptCode;
   mScriptObj = new QObject();
+  mPrintMemory = false;
+  mRssBaseline = -1;
+  mPrintEncode = false;
+  mWebpLossless = false;
+  mWebpQuality = 75;
+  mWebpMethod = 4;
+  mSvgImageMode = SvgInlineImages;
+  mPdfSinglePage = false;
+  mPdfImageDpi = 0;
 
   // This is not really nice, but some restructuring work is
   // needed anyway, so this should not be that bad for now.
   mPage->setCutyCapt(this);
 }
 
+void
+CutyCapt::setPrintMemory(bool printMemory, long rssBaseline) {
+  mPrintMemory = printMemory;
+  mRssBaseline = rssBaseline;
+}
+
+void
+CutyCapt::setPrintEncode(bool printEncode) {
+  mPrintEncode = printEncode;
+}
+
+void
+CutyCapt::setWebpOptions(bool lossless, int quality, int method) {
+  mWebpLossless = lossless;
+  mWebpQuality = quality;
+  mWebpMethod = method;
+}
+
+void
+CutyCapt::setSvgImageMode(SvgImageMode mode) {
+  mSvgImageMode = mode;
+}
+
+void
+CutyCapt::setPdfOptions(bool singlePage, int imageDpi) {
+  mPdfSinglePage = singlePage;
+  mPdfImageDpi = imageDpi;
+}
+
+void
+CutyCapt::setHostHints(const QString& path, const QUrl& url) {
+  mHostHints = path;
+  mDocumentOrigin = CutyOrigin(url);
+}
+
+// The hints file holds one "<document origin> <origin>" pair per
+// line, so what was learned from one site is only used for it.
+// More pre-connections than this would compete with the document.
+static const int CutyMaxPreconnects = 6;
+
+// Opens connections to the origins the previous capture used, so
+// that name lookups and TLS handshakes for them run in parallel
+// with the main document rather than one by one as it is parsed.
+void
+CutyCapt::preconnectHostHints() {
+#if QT_VERSION >= 0x050200
+  QFile file(mHostHints);
+  QByteArray document = mDocumentOrigin.toUtf8();
+  QNetworkAccessManager* manager = mPage->networkAccessManager();
+  int count = 0;
+
+  if (mHostHints.isEmpty() || !file.open(QIODevice::ReadOnly | QIODevice::Text))
+    return;
+
+  while (!file.atEnd() && count < CutyMaxPreconnects) {
+    QList<QByteArray> entry = file.readLine().trimmed().split(' ');
+
+    if (entry.size() != 2 || entry[0] != document)
+      continue;
+
+    QUrl origin(QString::fromUtf8(entry[1]));
+
+    if (origin.host().isEmpty())
+      continue;
+
+    if (origin.scheme() == "https")
+      manager->connectToHostEncrypted(origin.host(), origin.port(443));
+    else if (origin.scheme() == "http")
+      manager->connectToHost(origin.host(), origin.port(80));
+    else
+      continue;
+
+    count++;
+  }
+#endif
+}
+
+// Replaces the entries for this document and keeps all others. The
+// file is replaced atomically so that concurrent captures sharing it
+// never read a partial file; the last one to finish wins.
+void
+CutyCapt::saveHostHints() {
+#if QT_VERSION >= 0x050200
+  QByteArray document = mDocumentOrigin.toUtf8();
+  QByteArray hints;
+  QFile old(mHostHints);
+
+  // Keep the old hints if nothing could be loaded this time
+  if (mHostHints.isEmpty() || mHosts.isEmpty())
+    return;
+
+  if (old.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    while (!old.atEnd()) {
+      QByteArray line = old.readLine().trimmed();
+
+      if (!line.isEmpty() && !line.startsWith(document + ' '))
+        hints += line + '\n';
+    }
+    old.close();
+  }
+
+  foreach (const QString& origin, mHosts)
+    hints += document + ' ' + origin.toUtf8() + '\n';
+
+  QSaveFile file(mHostHints);
+
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    return;
+
+  file.write(hints);
+  file.commit();
+#endif
+}
+
 void
 CutyCapt::InitialLayoutCompleted() {
   mSawInitialLayout = true;
+  CutyStartupMark("initial layout completed");
 
   if (mSawInitialLayout && mSawDocumentComplete)
     TryDelayedRender();
@@ -191,6 +853,7 @@ CutyCapt::InitialLayoutCompleted() {
 void
 CutyCapt::DocumentComplete(bool /*ok*/) {
   mSawDocumentComplete = true;
+  CutyStartupMark("document complete");
 
   if (mSawInitialLayout && mSawDocumentComplete)
     TryDelayedRender();
@@ -224,20 +887,17 @@ CutyCapt::TryDelayedRender() {
     return;
   }
 
-  saveSnapshot();
-  QApplication::exit();
+  QApplication::exit(saveSnapshot() ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 void
 CutyCapt::Timeout() {
-  saveSnapshot();
-  QApplication::exit();
+  QApplication::exit(saveSnapshot() ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 void
 CutyCapt::Delayed() {
-  saveSnapshot();
-  QApplication::exit();
+  QApplication::exit(saveSnapshot() ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 void
@@ -250,10 +910,46 @@ CutyCapt::handleSslErrors(QNetworkReply* reply, QList<QSslError> errors) {
 }
 
 void
+CutyCapt::RecordHost(QNetworkReply* reply) {
+  QUrl url = reply->url();
+
+  if (url.scheme() != "http" && url.scheme() != "https")
+    return;
+
+  // Only origins that actually answered are worth connecting to
+  if (!reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).isValid())
+    return;
+
+  QString origin = CutyOrigin(url);
+
+  // The main document request opens its own connection anyway
+  if (origin == mDocumentOrigin)
+    return;
+
+  if (!mHosts.contains(origin))
+    mHosts.append(origin);
+}
+
+void
+CutyCapt::releaseMemory() {
+  // The snapshot has been written and the page will not be painted
+  // again, so whatever WebKit and the allocator hold on to can go.
+  mPage->triggerAction(QWebPage::Stop);
+#if QT_VERSION >= 0x040600
+  QWebSettings::clearMemoryCaches();
+#endif
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+bool
 CutyCapt::saveSnapshot() {
   QWebFrame *mainFrame = mPage->mainFrame();
   QPainter painter;
   const char* format = NULL;
+  bool saved = true;
+  long rssLoaded = CutyResidentSetSize();
 
   for (int ix = 0; CutyExtMap[ix].id != OtherFormat; ++ix)
     if (CutyExtMap[ix].id == mFormat)
@@ -272,16 +968,69 @@ CutyCapt::saveSnapshot() {
 
   switch (mFormat) {
     case SvgFormat: {
+      CutySvgDevice device(mOutput, mSvgImageMode == SvgExternalImages);
       QSvgGenerator svg;
-      svg.setFileName(mOutput);
+
+      if (mSvgImageMode == SvgInlineImages) {
+        svg.setFileName(mOutput);
+      } else if (device.open(QIODevice::WriteOnly)) {
+        svg.setOutputDevice(&device);
+      } else {
+        saved = false;
+        break;
+      }
+
       svg.setSize(mPage->viewportSize());
-      painter.begin(&svg);
+
+      if (!painter.begin(&svg)) {
+        saved = false;
+        break;
+      }
+
       mainFrame->render(&painter);
       painter.end();
+      device.close();
       break;
     }
     case PdfFormat:
     case PsFormat: {
+      if (mPdfSinglePage) {
+        // One page the size of the contents, painted like the raster
+        // formats instead of going through the print layout.
+        QPrinter printer(QPrinter::ScreenResolution);
+        printer.setOutputFileName(mOutput);
+        printer.setFullPage(true);
+        printer.setPaperSize(QSizeF(mPage->viewportSize()), QPrinter::DevicePixel);
+
+        if (!painter.begin(&printer)) {
+          saved = false;
+          break;
+        }
+
+        if (mPdfImageDpi > 0) {
+          CutyDownsampleDevice device(&painter, mPdfImageDpi);
+          QPainter downsample(&device);
+          mainFrame->render(&downsample);
+          downsample.end();
+        } else {
+          mainFrame->render(&painter);
+        }
+
+        painter.end();
+        break;
+      }
+
+      // QWebFrame::print() does not say whether it could write the
+      // file, so find out beforehand.
+      QFile probe(mOutput);
+
+      if (!probe.open(QIODevice::WriteOnly)) {
+        saved = false;
+        break;
+      }
+
+      probe.close();
+
       QPrinter printer;
       printer.setPageSize(QPrinter::A4);
       printer.setOutputFileName(mOutput);
@@ -292,7 +1041,12 @@ CutyCapt::saveSnapshot() {
 #if QT_VERSION < 0x050000
     case RenderTreeFormat: {
       QFile file(mOutput);
-      file.open(QIODevice::WriteOnly | QIODevice::Text);
+
+      if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        saved = false;
+        break;
+      }
+
       QTextStream s(&file);
       s.setCodec("utf-8");
       s << mainFrame->renderTreeDump();
@@ -302,7 +1056,12 @@ CutyCapt::saveSnapshot() {
     case InnerTextFormat:
     case HtmlFormat: {
       QFile file(mOutput);
-      file.open(QIODevice::WriteOnly | QIODevice::Text);
+
+      if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        saved = false;
+        break;
+      }
+
       QTextStream s(&file);
       s.setCodec("utf-8");
       s << (mFormat == InnerTextFormat  ? mainFrame->toPlainText() :
@@ -323,10 +1082,56 @@ CutyCapt::saveSnapshot() {
 #endif
       mainFrame->render(&painter);
       painter.end();
+
+      CutyClock clock;
+      QBuffer png;
+      qint64 pngTime = 0;
+
+      // PNG is the default output, so that is the baseline. It is
+      // encoded first as the WebP encoder may modify the image.
+      if (mPrintEncode && mFormat != PngFormat) {
+        png.open(QIODevice::WriteOnly);
+        clock.start();
+        image.save(&png, "png");
+        pngTime = clock.elapsed();
+      }
+
+      clock.start();
+
       // TODO: add quality
-      image.save(mOutput, format);
+#ifdef CUTYCAPT_WEBP
+      if (mFormat == WebpFormat)
+        saved = CutyWebpSave(image, mOutput, mWebpLossless, mWebpQuality,
+                             mWebpMethod);
+      else
+#endif
+        saved = image.save(mOutput, format);
+
+      if (mPrintEncode && saved) {
+        qDebug() << "[encode]" << format << QFileInfo(mOutput).size()
+                 << "bytes in" << clock.elapsed() << "ms";
+
+        if (mFormat != PngFormat)
+          qDebug() << "[encode] png" << png.size()
+                   << "bytes in" << pngTime << "ms";
+      }
     }
   };
+
+  CutyStartupMark("snapshot saved");
+
+  // The process exits right after the snapshot, so releasing memory
+  // is only worth it to measure how much a reused process would keep.
+  if (mPrintMemory) {
+    long rssAfter = CutyResidentSetSize();
+    releaseMemory();
+    qDebug() << "[memory] rss before load:" << mRssBaseline << "kB,"
+             << "after load:" << rssLoaded << "kB,"
+             << "after capture:" << rssAfter << "kB,"
+             << "after release:" << CutyResidentSetSize() << "kB";
+  }
+
+  return saved;
 }
 
 void
@@ -367,18 +1172,41 @@ CaptHelp(void) {
     "  --zoom-text-only=<on|off>      Whether to zoom only the text (default: off) \n"
     "  --http-proxy=<url>             Address for HTTP proxy server (default: none)\n"
 #endif
+#if QT_VERSION >= 0x040600
+    "  --object-cache=<min,max,total> WebKit object cache capacities in bytes      \n"
+    "  --page-cache=<int>             Pages kept in the back/forward cache         \n"
+    "  --dns-prefetch=<on|off>        DNS prefetching (stands in for a DNS cache)  \n"
+#endif
 #if CUTYCAPT_SCRIPT
     "  --inject-script=<path>         JavaScript that will be injected into pages  \n"
     "  --script-object=<string>       Property to hold state for injected script   \n"
     "  --expect-alert=<string>        Try waiting for alert(string) before capture \n"
     "  --debug-print-alerts           Prints out alert(...) strings for debugging. \n"
 #endif
+#ifdef CUTYCAPT_WEBP
+    "  --webp-lossless=<on|off>       Lossless WebP compression (default: off)     \n"
+    "  --webp-quality=<int>           WebP quality or effort, 0-100 (default: 75)  \n"
+    "  --webp-method=<int>            WebP speed/size trade-off, 0-6 (default: 4)  \n"
+#endif
+    "  --svg-images=<inline|shared|external> SVG image storage (default: inline)   \n"
+    "  --pdf-mode=<paged|single-page> Paginate, or one page (default: paged)       \n"
+    "  --pdf-image-dpi=<int>          Single page: downsample images (default: 0)  \n"
+#if QT_VERSION >= 0x050200
+    "  --host-hints=<path>            Learn and pre-connect to hosts the page uses \n"
+#endif
+    "  --debug-print-memory           Prints resident set size around the capture  \n"
+    "  --debug-print-encode           Prints output size and encode time vs. PNG   \n"
+    "  --startup-profile              Prints a timeline of initialization phases   \n"
 #if QT_VERSION >= 0x050000
+    "  --headless                     Use the offscreen platform, no X server      \n"
     "  --smooth                       Attempt to enable Qt's high-quality settings.\n"
 #endif
     "  --insecure                     Ignore SSL/TLS certificate errors            \n"
     " -----------------------------------------------------------------------------\n"
     "  <f> is svg,ps,pdf,itext,html,rtree,png,jpeg,mng,tiff,gif,bmp,ppm,xbm,xpm    \n"
+#ifdef CUTYCAPT_WEBP
+    "  or webp                                                                     \n"
+#endif
     " -----------------------------------------------------------------------------\n"
 #if CUTYCAPT_SCRIPT
     " The `inject-script` option can be used to inject script code into loaded web \n"
@@ -407,6 +1235,11 @@ main(int argc, char *argv[]) {
   int argMaxWait = 90000;
   int argVerbosity = 0;
   int argSmooth = 0;
+  int argPrintMemory = 0;
+  int argPrintEncode = 0;
+  int argWebpLossless = 0;
+  int argWebpQuality = 75;
+  int argWebpMethod = 4;
 
   const char* argUrl = NULL;
   const char* argUserStyle = NULL;
@@ -415,12 +1248,35 @@ main(int argc, char *argv[]) {
   const char* argIconDbPath = NULL;
   const char* argInjectScript = NULL;
   const char* argScriptObject = NULL;
+  const char* argHostHints = NULL;
   QString argOut;
 
   CutyCapt::OutputFormat format = CutyCapt::OtherFormat;
+  CutyCapt::SvgImageMode argSvgImages = CutyCapt::SvgInlineImages;
+  int argPdfSinglePage = 0;
+  int argPdfImageDpi = 0;
+
+  CutyStartupClock.start();
+
+  // Options that have to take effect before QApplication exists
+  for (int ax = 1; ax < argc; ++ax) {
+    if (strcmp("--startup-profile", argv[ax]) == 0) {
+      CutyStartupProfile = true;
+
+#if QT_VERSION >= 0x050000
+    } else if (strcmp("--headless", argv[ax]) == 0) {
+      // An explicit QT_QPA_PLATFORM or -platform still wins
+      if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+#endif
+    }
+  }
 
   QApplication app(argc, argv, true);
+  CutyStartupMark("application created");
+
   CutyPage page;
+  CutyStartupMark("page created");
 
   QNetworkAccessManager::Operation method =
     QNetworkAccessManager::GetOperation;
@@ -463,6 +1319,24 @@ main(int argc, char *argv[]) {
       page.setPrintAlerts(true);
       continue;
 #endif
+
+    } else if (strcmp("--debug-print-memory", s) == 0) {
+      argPrintMemory = 1;
+      continue;
+
+    } else if (strcmp("--debug-print-encode", s) == 0) {
+      argPrintEncode = 1;
+      continue;
+
+    } else if (strcmp("--startup-profile", s) == 0) {
+      // handled before QApplication is created
+      continue;
+
+#if QT_VERSION >= 0x050000
+    } else if (strcmp("--headless", s) == 0) {
+      // handled before QApplication is created
+      continue;
+#endif
     } 
 
     value = strchr(s, '=');
@@ -561,6 +1435,27 @@ main(int argc, char *argv[]) {
       page.setNetworkAccessManager(&manager);
 #endif
 
+#if QT_VERSION >= 0x040600
+    } else if (strncmp("--object-cache", s, nlen) == 0) {
+      QStringList caps = QString(value).split(',');
+
+      if (caps.size() != 3) {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+      QWebSettings::setObjectCacheCapacities(caps[0].toInt(),
+        caps[1].toInt(), caps[2].toInt());
+
+    } else if (strncmp("--page-cache", s, nlen) == 0) {
+      // TODO: add error checking here?
+      QWebSettings::setMaximumPagesInCache(atoi(value));
+
+    } else if (strncmp("--dns-prefetch", s, nlen) == 0) {
+      page.setAttribute(QWebSettings::DNSPrefetchEnabled, value);
+#endif
+
 #if CUTYCAPT_SCRIPT
     } else if (strncmp("--inject-script", s, nlen) == 0) {
       argInjectScript = value;
@@ -572,6 +1467,78 @@ main(int argc, char *argv[]) {
       page.setAlertString(value);
 #endif
 
+#ifdef CUTYCAPT_WEBP
+    } else if (strncmp("--webp-lossless", s, nlen) == 0) {
+      if (strcmp(value, "on") == 0)
+        argWebpLossless = 1;
+      else if (strcmp(value, "off") == 0)
+        argWebpLossless = 0;
+      else {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+    } else if (strncmp("--webp-quality", s, nlen) == 0) {
+      bool ok;
+      argWebpQuality = QByteArray(value).toInt(&ok);
+
+      if (!ok || argWebpQuality < 0 || argWebpQuality > 100) {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+    } else if (strncmp("--webp-method", s, nlen) == 0) {
+      bool ok;
+      argWebpMethod = QByteArray(value).toInt(&ok);
+
+      if (!ok || argWebpMethod < 0 || argWebpMethod > 6) {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+#endif
+
+    } else if (strncmp("--svg-images", s, nlen) == 0) {
+      if (strcmp(value, "inline") == 0)
+        argSvgImages = CutyCapt::SvgInlineImages;
+      else if (strcmp(value, "shared") == 0)
+        argSvgImages = CutyCapt::SvgSharedImages;
+      else if (strcmp(value, "external") == 0)
+        argSvgImages = CutyCapt::SvgExternalImages;
+      else {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+    } else if (strncmp("--pdf-mode", s, nlen) == 0) {
+      if (strcmp(value, "paged") == 0)
+        argPdfSinglePage = 0;
+      else if (strcmp(value, "single-page") == 0)
+        argPdfSinglePage = 1;
+      else {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+    } else if (strncmp("--pdf-image-dpi", s, nlen) == 0) {
+      bool ok;
+      argPdfImageDpi = QByteArray(value).toInt(&ok);
+
+      if (!ok || argPdfImageDpi < 0) {
+        // TODO: error
+        argHelp = 1;
+        break;
+      }
+
+#if QT_VERSION >= 0x050200
+    } else if (strncmp("--host-hints", s, nlen) == 0) {
+      argHostHints = value;
+#endif
+
     } else if (strncmp("--app-name", s, nlen) == 0) {
       app.setApplicationName(value);
 
@@ -632,6 +1599,8 @@ main(int argc, char *argv[]) {
       return EXIT_FAILURE;
   }
 
+  CutyStartupMark("command line parsed");
+
   // This used to use QUrl(argUrl) but that escapes %hh sequences
   // even though it should not, as URLs can assumed to be escaped.
   req.setUrl( QUrl::fromEncoded(argUrl) );
@@ -653,6 +1622,14 @@ main(int argc, char *argv[]) {
   CutyCapt main(&page, argOut, argDelay, format, scriptProp, scriptCode,
                 !!argInsecure, !!argSmooth);
 
+  main.setPrintEncode(!!argPrintEncode);
+  main.setWebpOptions(!!argWebpLossless, argWebpQuality, argWebpMethod);
+  main.setSvgImageMode(argSvgImages);
+  main.setPdfOptions(!!argPdfSinglePage, argPdfImageDpi);
+
+  if (argHostHints != NULL)
+    main.setHostHints(argHostHints, req.url());
+
   app.connect(&page,
     SIGNAL(loadFinished(bool)),
     &main,
@@ -710,10 +1687,29 @@ main(int argc, char *argv[]) {
     &main,
     SLOT(handleSslErrors(QNetworkReply*, QList<QSslError>)));
 
+  if (argHostHints != NULL) {
+    app.connect(page.networkAccessManager(),
+      SIGNAL(finished(QNetworkReply*)),
+      &main,
+      SLOT(RecordHost(QNetworkReply*)));
+
+    main.preconnectHostHints();
+  }
+
+  // Baseline for the growth a capture adds, see --debug-print-memory
+  if (argPrintMemory)
+    main.setPrintMemory(true, CutyResidentSetSize());
+
   if (!body.isNull())
     page.mainFrame()->load(req, method, body);
   else
     page.mainFrame()->load(req, method);
 
-  return app.exec();
+  CutyStartupMark("load requested");
+
+  int status = app.exec();
+
+  main.saveHostHints();
+
+  return status;
 }
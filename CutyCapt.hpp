@@ -29,6 +29,78 @@ protected:
   CutyCapt* mCutyCapt;
 };
 
+// Output device for QSvgGenerator that stores every distinct raster
+// image once and refers to repeated ones with <use>, and optionally
+// writes the images to separate files next to the document.
+class CutySvgDevice : public QIODevice {
+
+public:
+  CutySvgDevice(const QString& output, bool external);
+  bool open(OpenMode mode);
+  void close();
+
+protected:
+  qint64 readData(char* data, qint64 maxSize);
+  qint64 writeData(const char* data, qint64 maxSize);
+
+private:
+  void process(bool final);
+  QByteArray rewriteImage(const QByteArray& tag);
+  QFile mFile;
+  bool mExternal;
+  QByteArray mPending;
+  int mScanned;
+  QSet<QByteArray> mSeen;
+};
+
+// Paint engine that forwards everything to another painter, except
+// that raster images are first scaled down to a maximum resolution.
+class CutyDownsampleEngine : public QPaintEngine {
+
+public:
+  CutyDownsampleEngine(QPainter* target, int dpi);
+  bool begin(QPaintDevice* device);
+  bool end();
+  Type type() const;
+  void updateState(const QPaintEngineState& state);
+  void drawPath(const QPainterPath& path);
+  void drawPolygon(const QPointF* points, int pointCount, PolygonDrawMode mode);
+  void drawRects(const QRectF* rects, int rectCount);
+  void drawLines(const QLineF* lines, int lineCount);
+  void drawEllipse(const QRectF& rect);
+  void drawPoints(const QPointF* points, int pointCount);
+  void drawTextItem(const QPointF& p, const QTextItem& textItem);
+  void drawTiledPixmap(const QRectF& r, const QPixmap& pixmap, const QPointF& s);
+  void drawPixmap(const QRectF& r, const QPixmap& pm, const QRectF& sr);
+  void drawImage(const QRectF& r, const QImage& image, const QRectF& sr,
+                 Qt::ImageConversionFlags flags);
+
+private:
+  QSize limitFor(const QRectF& r) const;
+  QPixmap scaledTexture(const QPixmap& texture, const QSize& limit);
+  void updateBrush();
+  QPainter* mTarget;
+  qreal mScale;
+  QBrush mBrush;
+  qint64 mTextureKey;
+  QPixmap mTexture;
+};
+
+class CutyDownsampleDevice : public QPaintDevice {
+
+public:
+  CutyDownsampleDevice(QPainter* target, int dpi);
+  ~CutyDownsampleDevice();
+  QPaintEngine* paintEngine() const;
+
+protected:
+  int metric(PaintDeviceMetric metric) const;
+
+private:
+  QPaintDevice* mDevice;
+  CutyDownsampleEngine* mEngine;
+};
+
 class CutyCapt : public QObject {
   Q_OBJECT
 
@@ -37,7 +109,9 @@ public:
   // TODO: This should really be elsewhere and be named differently
   enum OutputFormat { SvgFormat, PdfFormat, PsFormat, InnerTextFormat, HtmlFormat,
     RenderTreeFormat, PngFormat, JpegFormat, MngFormat, TiffFormat, GifFormat,
-    BmpFormat, PpmFormat, XbmFormat, XpmFormat, OtherFormat };
+    BmpFormat, PpmFormat, XbmFormat, XpmFormat, WebpFormat, OtherFormat };
+
+  enum SvgImageMode { SvgInlineImages, SvgSharedImages, SvgExternalImages };
 
   CutyCapt(CutyPage* page,
            const QString& output,
@@ -48,6 +122,15 @@ public:
            bool insecure,
            bool smooth);
 
+  void setPrintMemory(bool printMemory, long rssBaseline);
+  void setPrintEncode(bool printEncode);
+  void setWebpOptions(bool lossless, int quality, int method);
+  void setSvgImageMode(SvgImageMode mode);
+  void setPdfOptions(bool singlePage, int imageDpi);
+  void setHostHints(const QString& path, const QUrl& url);
+  void preconnectHostHints();
+  void saveHostHints();
+
 private slots:
   void DocumentComplete(bool ok);
   void InitialLayoutCompleted();
@@ -55,10 +138,12 @@ private slots:
   void Timeout();
   void Delayed();
   void handleSslErrors(QNetworkReply* reply, QList<QSslError> errors);
+  void RecordHost(QNetworkReply* reply);
 
 private:
   void TryDelayedRender();
-  void saveSnapshot();
+  bool saveSnapshot();
+  void releaseMemory();
   bool mSawInitialLayout;
   bool mSawDocumentComplete;
 
@@ -72,4 +157,16 @@ protected:
   QString      mScriptCode;
   bool         mInsecure;
   bool         mSmooth;
+  bool         mPrintMemory;
+  long         mRssBaseline;
+  bool         mPrintEncode;
+  bool         mWebpLossless;
+  int          mWebpQuality;
+  int          mWebpMethod;
+  SvgImageMode mSvgImageMode;
+  bool         mPdfSinglePage;
+  int          mPdfImageDpi;
+  QString      mHostHints;
+  QString      mDocumentOrigin;
+  QStringList  mHosts;
 };